@@ -3,12 +3,21 @@
 #include "esphome/core/hal.h" // Добавляем этот заголовок для доступа к millis()
 #include "esphome/core/preferences.h"
 #include "esphome/core/helpers.h"
+#include <cinttypes>
+#include <cmath>
+#include <cstring>
+#ifdef USE_ESP32
+#include <freertos/FreeRTOS.h>
+#endif
 
 namespace esphome {
 namespace generator_control {
 
 static const char *TAG = "generator_control";
 static uint32_t generator_counter = 0;
+#ifdef USE_ESP32
+static portMUX_TYPE snap_mux = portMUX_INITIALIZER_UNLOCKED; // запись снимка без вытеснения
+#endif
 
 void GeneratorControl::setup() 
 {
@@ -56,10 +65,13 @@ void GeneratorControl::setup()
   this->bEnginOn = false;
   this->tMotHrSave = iTime()+900; // запись в eeprom раз в 15 минут
   this->set_output_value(GC_VAL_GAS_SET, 0);
+  this->set_output_value(GC_VAL_CHOKE_TIME, 0);
+  this->set_output_value(GC_VAL_CHOKE_FAULT, (float)GC_CHOKE_FAULT_NONE);
 
   if( this->last_control_ac_ )  { this->start_sequence_ac_ok(); }   // Флаг установлен - запускаем последовательность нормального напряжения
   else                          { this->start_sequence_ac_fail(); } // Флаг сброшен - запускаем последовательность включения генератора
 
+  this->update_snapshot();
 }
 
 void GeneratorControl::loop() 
@@ -71,6 +83,7 @@ void GeneratorControl::loop()
 
   this->CheckChangeFuelValue();
   this->CheckMotoHrAndOil();
+  this->CheckChoke(); // концевики заслонки проверяем на каждом проходе, а не раз в 500 мсек
 
   if( this->tsync_ha_flags<millis() )
   {
@@ -131,6 +144,80 @@ void GeneratorControl::loop()
       }
     }
   }
+
+  this->update_snapshot();
+}
+
+// Запись снимка: собираем локально, копируем под seqlock
+void GeneratorControl::update_snapshot()
+{
+  GeneratorSnapshot s{};
+  uint32_t now = millis();
+
+  s.regime      = this->current_regime_;
+  s.step        = this->current_step_;
+  s.timeout_ms  = ( this->sequence_running_ && this->twait_>now ) ? this->twait_-now : 0;
+  s.relay_mask  = 0;
+  for( size_t i=0; i<this->relays_.size() && i<32; i++ )
+  {
+    if( this->relays_[i]->state ) s.relay_mask |= 1u<<i;
+  }
+  s.engine_on   = this->bEnginOn;
+  s.restart     = this->restart;
+  s.motohr_sec  = this->tMotoHr;
+  s.oil_sec     = this->tOilMin;
+  s.total_power = this->nTotalPower;
+  // электрические значения берем с датчиков sinotimer, без шаблонных датчиков
+  bool online   = !this->is_binary_valid(GC_IN_SINOTIMER) || this->get_binary_value(GC_IN_SINOTIMER);
+  auto mb = [this, online](size_t index) -> float {
+    return ( online && index<this->modbus_sensors_.size() ) ? this->get_modbus_value(index) : NAN;
+  };
+  s.voltage     = mb(GC_MB_VOLT);
+  s.current     = mb(GC_MB_CURRENT);
+  s.freq        = mb(GC_MB_FREQ);
+  s.power       = mb(GC_MB_POWER);
+  s.total_power_meter = mb(GC_MB_TOTALPOWER);
+  s.electric_valid = online && !std::isnan(s.voltage);
+  s.choke_state = this->choke_state_;
+  s.choke_fault = this->choke_fault_;
+  s.choke_travel_ms = this->choke_travel_;
+  s.update_time = now;
+
+  uint32_t words[SNAP_WORDS] = {};
+  memcpy(words, &s, sizeof(s));
+
+  // окно записи короткое и не вытесняется - читатель на этом ядре не застанет нечетный seq
+#ifdef USE_ESP32
+  portENTER_CRITICAL(&snap_mux);
+#endif
+  uint32_t seq = this->snap_seq_.load(std::memory_order_relaxed);
+  this->snap_seq_.store(seq+1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  for( size_t i=0; i<SNAP_WORDS; i++ ) this->snap_words_[i].store(words[i], std::memory_order_relaxed);
+  this->snap_seq_.store(seq+2, std::memory_order_release);
+#ifdef USE_ESP32
+  portEXIT_CRITICAL(&snap_mux);
+#endif
+}
+
+// Чтение снимка: повторяем, пока не получим копию вне записи
+// Запись идет на другом ядре - уступаем процессор, а не крутимся в цикле
+GeneratorSnapshot GeneratorControl::snapshot() const
+{
+  uint32_t words[SNAP_WORDS];
+  uint32_t seq1, seq2;
+  do
+  {
+    seq1 = this->snap_seq_.load(std::memory_order_acquire);
+    if( seq1 & 1 ) { delay(1); seq2 = seq1+1; continue; }
+    for( size_t i=0; i<SNAP_WORDS; i++ ) words[i] = this->snap_words_[i].load(std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    seq2 = this->snap_seq_.load(std::memory_order_relaxed);
+  } while( (seq1 & 1) || seq1!=seq2 );
+
+  GeneratorSnapshot s;
+  memcpy(&s, words, sizeof(s));
+  return s;
 }
 
 
@@ -206,6 +293,87 @@ void GeneratorControl::CheckMotoHrAndOil()
   }
 }
 
+// Запуск привода заслонки до срабатывания концевика (close: IN5, open: IN6)
+// Единственная точка управления реле заслонки, кнопки HA тоже вызывают ее
+void GeneratorControl::choke_move(bool close)
+{
+  int in_end = close ? GC_IN5 : GC_IN6;
+
+  this->choke_stop(); // снимаем текущее движение, если оно было
+  // встречное реле выключаем всегда - мотор не должен получить оба направления
+  this->relays_[close ? GC_RELAY_AIR_TO_ON : GC_RELAY_AIR_TO_OFF]->turn_off();
+
+  // концевики не подключены - работаем как раньше, импульсом фиксированной длины
+  this->choke_timed_ = !this->is_binary_valid(in_end);
+
+  if( !this->choke_timed_ && this->get_binary_value(in_end) ) // заслонка уже в нужном положении
+  {
+    if( this->choke_fault_!=GC_CHOKE_FAULT_NONE ) // концевик подтвердил положение - снимаем неисправность
+    {
+      this->choke_fault_ = GC_CHOKE_FAULT_NONE;
+      this->set_output_value(GC_VAL_CHOKE_FAULT, (float)this->choke_fault_);
+    }
+    return;
+  }
+
+  ESP_LOGI(TAG, "Заслонка: %s", close ? "закрытие" : "открытие");
+  this->relays_[close ? GC_RELAY_AIR_TO_OFF : GC_RELAY_AIR_TO_ON]->turn_on();
+  this->choke_state_ = close ? GC_CHOKE_CLOSING : GC_CHOKE_OPENING;
+  this->choke_beg_time_ = millis();
+}
+
+void GeneratorControl::choke_stop()
+{
+  if( this->choke_state_==GC_CHOKE_IDLE ) return;
+
+  this->relays_[GC_RELAY_AIR_TO_OFF]->turn_off();
+  this->relays_[GC_RELAY_AIR_TO_ON]->turn_off();
+  this->choke_state_ = GC_CHOKE_IDLE;
+}
+
+// Контроль хода заслонки: останов по концевику или по максимальному времени хода
+void GeneratorControl::CheckChoke()
+{
+  if( this->choke_state_==GC_CHOKE_IDLE ) return;
+
+  bool     close  = this->choke_state_==GC_CHOKE_CLOSING;
+  uint32_t travel = millis() - this->choke_beg_time_;
+
+  if( this->choke_timed_ ) // без концевиков ход не измеряем
+  {
+    if( travel>=GC_CHOKE_PULSE ) this->choke_stop();
+    return;
+  }
+
+  if( this->get_binary_value(close ? GC_IN5 : GC_IN6) ) // дошла до концевика
+  {
+    this->choke_stop();
+    this->choke_travel_ = travel;
+    if( travel>GC_CHOKE_SLOW_TRAVEL )
+    {
+      this->choke_fault_ = GC_CHOKE_FAULT_SLOW;
+      ESP_LOGW(TAG, "Заслонка: медленный ход %" PRIu32 " мсек", travel);
+    }
+    else
+    {
+      this->choke_fault_ = GC_CHOKE_FAULT_NONE;
+      ESP_LOGI(TAG, "Заслонка: ход %" PRIu32 " мсек", travel);
+    }
+  }
+  else
+  if( travel>GC_CHOKE_MAX_TRAVEL ) // концевик так и не сработал
+  {
+    this->choke_stop();
+    this->choke_travel_ = travel;
+    this->choke_fault_ = GC_CHOKE_FAULT_STUCK;
+    ESP_LOGW(TAG, "Заслонка: нет концевика %s за %" PRIu32 " мсек, заклинило?", close ? "IN5" : "IN6", travel);
+  }
+  else return;
+
+  this->set_output_value(GC_VAL_CHOKE_TIME, (float)this->choke_travel_);
+  this->set_output_value(GC_VAL_CHOKE_FAULT, (float)this->choke_fault_);
+}
+
 // Метод для программного нажатия кнопки
 void GeneratorControl::press_button(size_t index) {
   if (index < this->buttons_.size() && this->buttons_[index] != nullptr) {
@@ -362,14 +530,12 @@ void GeneratorControl::sequence_start(int step)
         break;
         
       case GC_STEP_START_AIRCLOSE:
-        if( !this->get_binary_value(GC_IN5) )
-        {
-            this->buttons_[GC_BUTTON_AIRCLOSE]->press();
-        }
+        this->choke_move(true);
         this->sequence_setstep( GC_STEP_START_STARTER_ON );
         break;
         
       case GC_STEP_START_STARTER_ON:
+        if( this->choke_state_!=GC_CHOKE_IDLE ) break; // ждем окончания хода заслонки
         this->twaitcmd = millis()+15000; // 15 секунд время запуска генератора
         this->relays_[GC_RELAY_STARTER]->turn_on();
         this->sequence_setstep( GC_STEP_START_STARTER_WAIT );
@@ -406,7 +572,7 @@ void GeneratorControl::sequence_start(int step)
         {
             if( this->restart%2==0 ) 
             {
-                this->buttons_[GC_BUTTON_AIROPEN]->press();
+                this->choke_move(false);
                 this->sequence_setstep( GC_STEP_START_STARTER_ON );
             }
             else
@@ -418,7 +584,7 @@ void GeneratorControl::sequence_start(int step)
         break;
         
       case GC_STEP_START_AIROPEN:
-        this->buttons_[GC_BUTTON_AIROPEN]->press();
+        this->choke_move(false);
         sequence_setdelay(30000);  // подключения нагрузки
         this->sequence_setstep( GC_STEP_START_POWER_ON );
         break;
@@ -455,6 +621,7 @@ void GeneratorControl::sequence_stop(int step)
         
       case GC_STEP_STOP_ENGINE_OFF:
         // Выключаем все реле
+        this->choke_stop();
         for (auto relay : this->relays_) {
             relay->turn_off();
         }
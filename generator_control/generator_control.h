@@ -7,6 +7,8 @@
 #include "esphome/components/binary_sensor/binary_sensor.h"
 #include "esphome/core/hal.h" // Добавляем этот заголовок для доступа к milli
 #include <vector>
+#include <atomic>
+#include <type_traits>
 
 #define GC_REGIME_NULL      0
 #define GC_REGIME_STOP      1
@@ -48,6 +50,8 @@
 #define GC_RELAY_AIR_TO_ON          4
 #define GC_RELAY_POWER              5
 
+// кнопки заслонки сами вызывают choke_move(), компонент их не нажимает;
+// buttons_ используется только в press_button()
 #define GC_BUTTON_AIRCLOSE          0
 #define GC_BUTTON_AIROPEN           1
 
@@ -65,6 +69,12 @@
 #define GC_IN_AC_CTRL               6
 #define GC_IN_SINOTIMER             7
 
+#define GC_MB_VOLT                  0
+#define GC_MB_CURRENT               1
+#define GC_MB_FREQ                  2
+#define GC_MB_POWER                 3
+#define GC_MB_TOTALPOWER            4
+
 #define GC_VAL_REGIME               0
 #define GC_VAL_REGSTEP              1
 #define GC_VAL_TIMEOUT              2
@@ -77,6 +87,22 @@
 #define GC_VAL_POWER                9
 #define GC_VAL_TOTALPOWER           10
 #define GC_VAL_TOTALPOWER_SAVE      11
+#define GC_VAL_CHOKE_TIME           12
+#define GC_VAL_CHOKE_FAULT          13
+
+// состояние привода заслонки
+#define GC_CHOKE_IDLE               0
+#define GC_CHOKE_CLOSING            1
+#define GC_CHOKE_OPENING            2
+
+// код неисправности привода заслонки
+#define GC_CHOKE_FAULT_NONE         0
+#define GC_CHOKE_FAULT_SLOW         1   // дошла до концевика, но медленнее нормы
+#define GC_CHOKE_FAULT_STUCK        2   // концевик не сработал за максимальное время хода
+
+#define GC_CHOKE_MAX_TRAVEL         2000  // мсек, максимальное время хода заслонки
+#define GC_CHOKE_SLOW_TRAVEL        800   // мсек, ход дольше - заслонка туго ходит
+#define GC_CHOKE_PULSE              500   // мсек, импульс при отсутствии концевиков
 
 
 extern int generator_motohr_eeprom;
@@ -86,6 +112,34 @@ extern int generator_gas_eeprom;
 namespace esphome {
 namespace generator_control {
 
+// Снимок состояния генератора, обновляется раз за проход loop() под seqlock.
+// Запись идет в критической секции, поэтому snapshot() можно вызывать из любой
+// задачи FreeRTOS любого приоритета; из ISR вызывать нельзя (возможен delay(1)).
+// В yaml лямбдах: auto s = id(my_generator).snapshot();
+struct GeneratorSnapshot {
+  int      regime;          // GC_REGIME_*
+  int      step;            // GC_STEP_*
+  uint32_t timeout_ms;      // осталось до следующего шага, мсек
+  uint32_t relay_mask;      // бит N - реле GC_RELAY_* с индексом N включено
+  bool     engine_on;       // генератор заведен (AI3)
+  int      restart;         // номер попытки запуска
+  int      motohr_sec;      // моточасы, сек
+  int      oil_sec;         // остаток топлива, сек
+  int      total_power;     // сохраненный счетчик, кВт*ч
+  bool     electric_valid;  // sinotimer на связи, электрические значения достоверны
+  float    voltage;         // напрямую из modbus_sensors, NAN если нет данных
+  float    current;
+  float    freq;
+  float    power;
+  float    total_power_meter;
+  int      choke_state;     // GC_CHOKE_*
+  int      choke_fault;     // GC_CHOKE_FAULT_*
+  uint32_t choke_travel_ms;
+  uint32_t update_time;     // millis() обновления снимка
+};
+
+static_assert(std::is_trivially_copyable<GeneratorSnapshot>::value, "снимок копируется побайтно");
+
 class GeneratorControl : public Component {
  public:
   void setup() override;
@@ -112,6 +166,9 @@ class GeneratorControl : public Component {
   
   // Метод для программного нажатия кнопки
   void press_button(size_t index);
+
+  // Привод заслонки (close=true - закрыть), вызывается также из кнопок в yaml
+  void choke_move(bool close);
   
   // Методы для получения значений датчиков
   float get_analog_value(size_t index) const;
@@ -121,8 +178,12 @@ class GeneratorControl : public Component {
 
   void CheckMotoHrAndOil();
   void CheckChangeFuelValue();
+  void CheckChoke();
   uint32_t iTime() { return millis()/1000; }
 
+  // Согласованный снимок состояния без обращения к выходным датчикам
+  GeneratorSnapshot snapshot() const;
+
  protected:
   void start_sequence();
   void stop_sequence();
@@ -136,6 +197,8 @@ class GeneratorControl : public Component {
   void sequence_start(int step);
   void sequence_ac_ok(int step);
   void sequence_ac_fail(int step);
+  void choke_stop();
+  void update_snapshot();
 
   ESPPreferenceObject  generator_motohr_eeprom;
   ESPPreferenceObject  generator_gas_eeprom;
@@ -169,6 +232,17 @@ class GeneratorControl : public Component {
   uint32_t  tEnginOnBegTime{0};
   bool      bEnginOn{false};
   uint32_t  tMotHrSave{0};
+
+  int       choke_state_{GC_CHOKE_IDLE};   // текущее движение заслонки
+  int       choke_fault_{GC_CHOKE_FAULT_NONE};
+  uint32_t  choke_beg_time_{0};            // millis() начала хода
+  uint32_t  choke_travel_{0};              // измеренное время последнего хода, мсек
+  bool      choke_timed_{false};           // ход по времени, концевики не подключены
+
+  // снимок хранится словами, каждое слово атомарно - без гонки данных при чтении
+  static constexpr size_t SNAP_WORDS = (sizeof(GeneratorSnapshot)+3)/4;
+  std::atomic<uint32_t>  snap_words_[SNAP_WORDS]{};  // пишется только из loop()
+  std::atomic<uint32_t>  snap_seq_{0};               // нечетное - идет запись
 };
 
 } // namespace generator_control